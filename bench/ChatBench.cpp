@@ -0,0 +1,920 @@
+/**
+ * @file ChatBench.cpp
+ * @brief Load scenarios against running chat servers, reporting latency percentiles
+ *        and throughput.
+ *
+ * Every scenario drives its connections from one ChatClientLoop on one thread, so all
+ * times come from the same clock. Start the server(s) a scenario needs first; the
+ * scenario list below says how. Each prints one result block, so runs against
+ * differently configured servers can be compared line by line.
+ *
+ * Scenarios:
+ *  - pool: a probe asks for /mentions every 10 ms while --connections publishers keep
+ *    the server's CPU stages busy. Prints the probe's latency idle and under load and
+ *    the publishers' acknowledged messages/s. Start the server with --cpu-stage-us N.
+ *  - throughput: --connections publishers and --subscribers subscribers in one room.
+ *    Prints messages/s delivered and publish-to-delivery latency. Compare a server
+ *    with --fake-numa-nodes N against one without.
+ *  - latency: one message in flight between two connections in a room; prints the
+ *    broadcast latency percentiles. Compare a server with --busy-poll MICROS against
+ *    the default blocking one.
+ *  - catchup: reconnecting clients with and without a local history cache; prints the
+ *    time from connecting to the room being on screen and what the server sent.
+ *  - bots: one process with --connections connections (default 1000) on one loop
+ *    thread, publishing in 50 rooms. Prints messages/s published and delivered and
+ *    the process's CPU.
+ *  - sweep: senders publish into one room at rising fixed rates; prints delivered
+ *    messages/s and latency percentiles per rate. Compare a server with
+ *    --flush-policy immediate against the default adaptive one.
+ *  - lanes: a reader on a ~16 MB/s link asks for 2000 /history pages; prints its
+ *    control (__SENT__) and live chat latency idle and while the pages drain.
+ *  - relay: a publisher on the origin posts into #announce and --subscribers
+ *    subscribers on the --leaves relays time delivery; with --origin-pid, also prints
+ *    the origin's CPU per message. Run it once per relay tree.
+ *
+ * Usage: bench SCENARIO [--host ADDR] [--port N] [--seconds N] [--connections N]
+ *                       [--subscribers N] [--leaves PORT[,PORT...]] [--origin-pid N]
+ *
+ * @author
+ * @version 1.0
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include "../client/libchatclient.h"
+
+using namespace std;
+
+/**
+ * @brief Bench options; scenarios ignore the ones they do not use.
+ */
+struct BenchConfig {
+    string scenario;
+    string host = "127.0.0.1";
+    unsigned short port = 12345;
+    unsigned seconds = 10;      // Length of each measured phase
+    unsigned connections = 0;   // Load connections; 0 = the scenario's default
+    unsigned subscribers = 8;   // Receiving connections
+    vector<unsigned short> leaves; // relay: ports of the servers subscribers use; empty = the origin
+    unsigned originPid = 0;     // relay: origin server process, for its CPU time
+};
+
+typedef chrono::steady_clock Clock;
+
+/**
+ * @brief State of one bench connection; scenarios set onEvent to watch its lines.
+ */
+struct BenchConnection {
+    ChatConnection* connection = nullptr;
+    function<void(const ChatEvent&)> onEvent;
+};
+
+/**
+ * @brief Latency samples in microseconds.
+ */
+struct LatencySamples {
+    vector<double> us;
+
+    void Add(Clock::time_point start) {
+        us.push_back(chrono::duration<double, micro>(Clock::now() - start).count());
+    }
+
+    double Percentile(double fraction) {
+        if (us.empty()) {
+            return 0;
+        }
+        sort(us.begin(), us.end());
+        return us[min(us.size() - 1, static_cast<size_t>(fraction * us.size()))];
+    }
+
+    /**
+     * @brief "n, p50, p99, p99.9, max" in microseconds.
+     */
+    string Summary() {
+        char text[160];
+        snprintf(text, sizeof(text), "n %zu, p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us", us.size(),
+                 Percentile(0.5), Percentile(0.99), Percentile(0.999), us.empty() ? 0.0 : Percentile(1.0));
+        return text;
+    }
+};
+
+/**
+ * @brief Hands each line to the onEvent of the BenchConnection it arrived on.
+ */
+void RouteEvents(ChatClientLoop& loop) {
+    loop.OnMessage([](ChatConnection& connection, const ChatEvent& event) {
+        BenchConnection* state = static_cast<BenchConnection*>(connection.userData);
+        if (state && state->onEvent) {
+            state->onEvent(event);
+        }
+    });
+}
+
+/**
+ * @brief Runs the loop until done() holds or timeoutMs passes.
+ * @return false on timeout.
+ */
+bool RunUntil(ChatClientLoop& loop, const function<bool()>& done, int timeoutMs) {
+    auto deadline = Clock::now() + chrono::milliseconds(timeoutMs);
+    while (!done()) {
+        if (Clock::now() >= deadline) {
+            return false;
+        }
+        loop.RunOnce(1);
+    }
+    return true;
+}
+
+/**
+ * @brief Opens a signed-in connection, joined to room unless it is the lobby, and waits
+ *        for the server to confirm the room.
+ * @return false (after printing why) if the server cannot be reached.
+ */
+bool OpenConnection(ChatClientLoop& loop, const BenchConfig& config, BenchConnection& state, const string& name,
+                    const string& room) {
+    state.connection = loop.Connect(config.host, config.port);
+    if (state.connection == nullptr || !loop.WaitConnected(state.connection, 5000)) {
+        cerr << "Cannot connect to " << config.host << ":" << config.port << ". Error: " << WSAGetLastError() << endl;
+        return false;
+    }
+    state.connection->userData = &state;
+    loop.SignIn(state.connection, name);
+    if (room == "lobby") {
+        return true;
+    }
+    bool joined = false;
+    auto previous = state.onEvent;
+    state.onEvent = [&joined, &room](const ChatEvent& event) {
+        joined = joined || (event.kind == ChatEvent::Room && event.Text() == room);
+    };
+    loop.Join(state.connection, room);
+    bool confirmed = RunUntil(loop, [&joined]() { return joined; }, 5000);
+    state.onEvent = previous;
+    if (!confirmed) {
+        cerr << name << " could not join #" << room << "." << endl;
+    }
+    return confirmed;
+}
+
+/**
+ * @brief Chat text carrying its send time, so a receiver can time the delivery.
+ */
+string StampedText() {
+    return "load " + to_string(chrono::duration_cast<chrono::nanoseconds>(Clock::now().time_since_epoch()).count());
+}
+
+/**
+ * @brief Send time of a line made by StampedText, or the epoch if it is not one.
+ */
+Clock::time_point StampOf(const ChatEvent& event) {
+    string text = event.Text(); // "name : load <ns>"
+    size_t space = text.rfind(' ');
+    if (space == string::npos || space < 4 || text.compare(space - 4, 4, "load") != 0) {
+        return Clock::time_point();
+    }
+    return Clock::time_point(chrono::nanoseconds(strtoll(text.c_str() + space + 1, nullptr, 10)));
+}
+
+/**
+ * @brief Keeps window chat lines in flight on a connection: each __SENT__ sends the next.
+ */
+struct Publisher {
+    static const unsigned Window = 8;
+
+    BenchConnection state;
+    uint64_t acked = 0;
+    bool running = false;
+
+    void Start(ChatClientLoop& loop) {
+        running = true;
+        state.onEvent = [this, &loop](const ChatEvent& event) {
+            if (event.kind == ChatEvent::Sent) {
+                ++acked;
+                if (running) {
+                    loop.Publish(state.connection, StampedText());
+                }
+            }
+        };
+        for (unsigned i = 0; i < Window; ++i) {
+            loop.Publish(state.connection, StampedText());
+        }
+    }
+};
+
+/**
+ * @brief Counts the room's messages and times each from its StampedText.
+ */
+struct Subscriber {
+    BenchConnection state;
+    LatencySamples* samples = nullptr; // Shared by all subscribers; null while warming up
+    uint64_t delivered = 0;
+
+    void Attach() {
+        state.onEvent = [this](const ChatEvent& event) {
+            Clock::time_point sentAt;
+            if (event.kind == ChatEvent::Message && samples && (sentAt = StampOf(event)) != Clock::time_point()) {
+                ++delivered;
+                samples->Add(sentAt);
+            }
+        };
+    }
+};
+
+/**
+ * @brief Asks for /mentions at a fixed interval and times each answer. The server
+ *        answers it on the client's own thread, so the time is the I/O path's latency.
+ */
+struct ControlProbe {
+    static const int IntervalMs = 10;
+
+    BenchConnection state;
+    LatencySamples samples;
+    Clock::time_point sentAt;
+    Clock::time_point nextAt;
+    bool waiting = false;
+
+    void Attach() {
+        state.onEvent = [this](const ChatEvent& event) {
+            if (waiting && event.kind == ChatEvent::Notice && event.Text().find("mentions") != string::npos) {
+                samples.Add(sentAt);
+                waiting = false;
+            }
+        };
+    }
+
+    /** @brief Sends the next probe when one is due; call on every loop turn. */
+    void Tick(ChatClientLoop& loop) {
+        Clock::time_point now = Clock::now();
+        if (!waiting && now >= nextAt) {
+            sentAt = now;
+            nextAt = now + chrono::milliseconds(IntervalMs);
+            waiting = true;
+            loop.Command(state.connection, "/mentions");
+        }
+    }
+
+    /** @brief Probes for seconds and returns the samples taken. */
+    LatencySamples Measure(ChatClientLoop& loop, unsigned seconds) {
+        samples = LatencySamples();
+        auto end = Clock::now() + chrono::seconds(seconds);
+        while (Clock::now() < end) {
+            Tick(loop);
+            loop.RunOnce(1);
+        }
+        RunUntil(loop, [this]() { return !waiting; }, 5000);
+        return samples;
+    }
+};
+
+/**
+ * @brief pool: I/O latency while the compute pool is saturated.
+ *
+ * Start the server with --cpu-stage-us N (e.g. 200) so every chat line costs N us of
+ * CPU on the pool. The probe is timed first on an idle server, then while the
+ * publishers keep Publisher::Window lines each in flight. With the stages on the pool
+ * the probe's latency should stay near its idle value however busy the cores are.
+ */
+bool RunPool(const BenchConfig& config) {
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    ControlProbe probe;
+    if (!OpenConnection(loop, config, probe.state, "probe", "lobby")) {
+        return false;
+    }
+    probe.Attach();
+    unsigned count = config.connections > 0 ? config.connections : 2 * max(1u, thread::hardware_concurrency());
+    deque<Publisher> publishers(count); // Stable addresses for the callbacks
+    for (unsigned i = 0; i < count; ++i) {
+        if (!OpenConnection(loop, config, publishers[i].state, "load" + to_string(i), "bench")) {
+            return false;
+        }
+    }
+
+    LatencySamples idle = probe.Measure(loop, config.seconds);
+    for (Publisher& publisher : publishers) {
+        publisher.Start(loop);
+    }
+    auto loadStart = Clock::now();
+    LatencySamples loaded = probe.Measure(loop, config.seconds);
+    uint64_t acked = 0;
+    for (Publisher& publisher : publishers) {
+        publisher.running = false;
+        acked += publisher.acked;
+    }
+    chrono::duration<double> loadSeconds = Clock::now() - loadStart;
+
+    cout << "Probe latency, idle:   " << idle.Summary() << endl;
+    cout << "Probe latency, loaded: " << loaded.Summary() << endl;
+    cout << "Load: " << count << " publisher(s), " << static_cast<uint64_t>(acked / loadSeconds.count())
+         << " messages/s acknowledged." << endl;
+    return true;
+}
+
+/**
+ * @brief throughput: delivered messages/s and delivery latency for one busy room.
+ */
+bool RunThroughput(const BenchConfig& config) {
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    unsigned count = config.connections > 0 ? config.connections : 4;
+    deque<Publisher> publishers(count);
+    deque<Subscriber> subscribers(config.subscribers);
+    for (unsigned i = 0; i < config.subscribers; ++i) {
+        if (!OpenConnection(loop, config, subscribers[i].state, "sub" + to_string(i), "bench")) {
+            return false;
+        }
+        subscribers[i].Attach();
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (!OpenConnection(loop, config, publishers[i].state, "load" + to_string(i), "bench")) {
+            return false;
+        }
+        publishers[i].Start(loop);
+    }
+
+    // One second of warm-up, then measure
+    RunUntil(loop, []() { return false; }, 1000);
+    LatencySamples latency;
+    for (Subscriber& subscriber : subscribers) {
+        subscriber.samples = &latency;
+    }
+    auto start = Clock::now();
+    RunUntil(loop, []() { return false; }, static_cast<int>(config.seconds * 1000));
+    chrono::duration<double> elapsed = Clock::now() - start;
+    uint64_t delivered = 0;
+    for (Subscriber& subscriber : subscribers) {
+        subscriber.samples = nullptr;
+        delivered += subscriber.delivered;
+    }
+    for (Publisher& publisher : publishers) {
+        publisher.running = false;
+    }
+
+    cout << count << " publisher(s), " << config.subscribers << " subscriber(s): "
+         << static_cast<uint64_t>(delivered / elapsed.count()) << " messages/s delivered." << endl;
+    cout << "Delivery latency: " << latency.Summary() << endl;
+    return true;
+}
+
+/**
+ * @brief latency: broadcast latency of single messages through an otherwise idle room.
+ *
+ * The sender publishes the next line only when the receiver has the previous one, so
+ * each sample is one uncontended hop through the server.
+ */
+bool RunLatency(const BenchConfig& config) {
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    BenchConnection sender;
+    Subscriber receiver;
+    if (!OpenConnection(loop, config, receiver.state, "receiver", "latency") ||
+        !OpenConnection(loop, config, sender, "sender", "latency")) {
+        return false;
+    }
+    LatencySamples latency;
+    receiver.samples = &latency;
+    receiver.Attach();
+
+    uint64_t expected = 0;
+    auto end = Clock::now() + chrono::seconds(config.seconds);
+    while (Clock::now() < end) {
+        loop.Publish(sender.connection, StampedText());
+        ++expected;
+        if (!RunUntil(loop, [&receiver, expected]() { return receiver.delivered == expected; }, 5000)) {
+            cerr << "Message " << expected << " was not delivered." << endl;
+            return false;
+        }
+    }
+
+    cout << "Broadcast latency: " << latency.Summary() << endl;
+    return true;
+}
+
+/**
+ * @brief catchup: what a reconnecting client waits for before its room is on screen.
+ *
+ * A writer fills a room with Backlog messages. Then each round a new client connects,
+ * signs in, joins and sends __SINCE__: without a cache it asks for 0 and renders when
+ * the server's latest page arrives; with a cache it has already rendered from disk
+ * (the client prints that time itself) and only waits for the CachedBehind messages it
+ * missed. Prints connect-to-first-message and connect-to-caught-up times and what the
+ * server sent per reconnect.
+ */
+bool RunCatchUp(const BenchConfig& config) {
+    const unsigned Backlog = 500;
+    const unsigned CachedBehind = 10;
+    const unsigned NoCachePage = 50; // The server's page for a client without a cache
+    const unsigned Rounds = 100;
+
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    BenchConnection writer;
+    if (!OpenConnection(loop, config, writer, "writer", "catchup")) {
+        return false;
+    }
+    vector<uint64_t> ids;
+    writer.onEvent = [&ids](const ChatEvent& event) {
+        if (event.kind == ChatEvent::Sent) {
+            ids.push_back(event.id);
+        }
+    };
+    for (unsigned i = 0; i < Backlog; ++i) {
+        loop.Publish(writer.connection, "backlog line " + to_string(i) + " of the catch-up scenario");
+    }
+    if (!RunUntil(loop, [&ids]() { return ids.size() == Backlog; }, 10000)) {
+        cerr << "Only " << ids.size() << " of " << Backlog << " backlog messages were acknowledged." << endl;
+        return false;
+    }
+
+    for (bool cached : { false, true }) {
+        uint64_t since = cached ? ids[Backlog - CachedBehind - 1] : 0;
+        unsigned expected = cached ? CachedBehind : NoCachePage;
+        LatencySamples firstMessage;
+        LatencySamples caughtUp;
+        uint64_t bytes = 0;
+        for (unsigned round = 0; round < Rounds; ++round) {
+            BenchConnection reader;
+            unsigned received = 0;
+            auto connectAt = Clock::now();
+            if (!OpenConnection(loop, config, reader, (cached ? "cached" : "fresh") + to_string(round), "catchup")) {
+                return false;
+            }
+            reader.onEvent = [&](const ChatEvent& event) {
+                if (event.kind == ChatEvent::Message && event.id > since) {
+                    if (received++ == 0) {
+                        firstMessage.Add(connectAt);
+                    }
+                    bytes += event.lineLength + 1;
+                }
+            };
+            loop.Since(reader.connection, since);
+            if (!RunUntil(loop, [&received, expected]() { return received >= expected; }, 5000)) {
+                cerr << "Round " << round << " got " << received << " of " << expected << " messages." << endl;
+                return false;
+            }
+            caughtUp.Add(connectAt);
+            reader.connection->userData = nullptr; // reader goes out of scope
+            loop.Disconnect(reader.connection);
+            loop.RunOnce(0);
+        }
+        cout << (cached ? "Cache, " + to_string(CachedBehind) + " behind:" : string("No cache:")) << endl;
+        cout << "  connect to first message: " << firstMessage.Summary() << endl;
+        cout << "  connect to caught up:     " << caughtUp.Summary() << endl;
+        cout << "  server sent " << expected << " message(s), " << bytes / Rounds << " bytes per reconnect" << endl;
+    }
+    return true;
+}
+
+/**
+ * @brief CPU time (user + kernel) a process has used so far, in seconds.
+ */
+double ProcessCpuSeconds(HANDLE process = GetCurrentProcess()) {
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(process, &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    auto ticks = [](const FILETIME& time) {
+        return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; // 100 ns units
+    };
+    return (ticks(kernel) + ticks(user)) / 1e7;
+}
+
+/**
+ * @brief bots: one bot process holding --connections connections (default 1000) on a
+ *        single ChatClientLoop thread.
+ *
+ * The connections are spread over Rooms rooms (the server has at most 64) and each
+ * keeps Publisher::Window lines in flight, so every line is delivered to all members
+ * of its room. Prints the time to sign in and join them all, the lines acknowledged
+ * and delivered per second, and how much of a core the bot process used.
+ */
+bool RunBots(const BenchConfig& config) {
+    const unsigned Rooms = 50;
+
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    unsigned count = config.connections > 0 ? config.connections : 1000;
+    deque<Publisher> bots(count);
+    vector<uint64_t> delivered(count, 0);
+    auto connectStart = Clock::now();
+    for (unsigned i = 0; i < count; ++i) {
+        if (!OpenConnection(loop, config, bots[i].state, "bot" + to_string(i), "bots" + to_string(i % Rooms))) {
+            return false;
+        }
+    }
+    chrono::duration<double> connectSeconds = Clock::now() - connectStart;
+    for (unsigned i = 0; i < count; ++i) {
+        bots[i].Start(loop);
+        auto publish = bots[i].state.onEvent;
+        uint64_t* received = &delivered[i];
+        bots[i].state.onEvent = [publish, received](const ChatEvent& event) {
+            if (event.kind == ChatEvent::Message) {
+                ++*received;
+            }
+            publish(event);
+        };
+    }
+
+    // One second of warm-up, then measure
+    RunUntil(loop, []() { return false; }, 1000);
+    auto totals = [&bots, &delivered]() {
+        pair<uint64_t, uint64_t> sums(0, 0); // acknowledged, delivered
+        for (const Publisher& bot : bots) {
+            sums.first += bot.acked;
+        }
+        for (uint64_t received : delivered) {
+            sums.second += received;
+        }
+        return sums;
+    };
+    pair<uint64_t, uint64_t> before = totals();
+    double cpuStart = ProcessCpuSeconds();
+    auto start = Clock::now();
+    RunUntil(loop, []() { return false; }, static_cast<int>(config.seconds * 1000));
+    chrono::duration<double> elapsed = Clock::now() - start;
+    double cpu = ProcessCpuSeconds() - cpuStart;
+    pair<uint64_t, uint64_t> after = totals();
+    for (Publisher& bot : bots) {
+        bot.running = false;
+    }
+
+    cout << count << " connection(s) in " << min(count, Rooms) << " room(s), signed in and joined in "
+         << static_cast<uint64_t>(connectSeconds.count() * 1000) << " ms." << endl;
+    cout << "Published: " << static_cast<uint64_t>((after.first - before.first) / elapsed.count())
+         << " messages/s acknowledged." << endl;
+    cout << "Received:  " << static_cast<uint64_t>((after.second - before.second) / elapsed.count())
+         << " messages/s delivered." << endl;
+    printf("Bot process CPU: %.2f of a core.\n", cpu / elapsed.count());
+    return true;
+}
+
+/**
+ * @brief sweep: delivery latency and throughput as the offered load rises.
+ *
+ * --connections senders (default 4) publish into one room at a fixed total rate,
+ * without waiting for acks, and --subscribers subscribers time every delivery. Each
+ * rate in Rates runs for --seconds; then publishing stops and the subscribers get up
+ * to DrainMs to catch up before the next step. One row per rate, so runs against
+ * --flush-policy immediate and adaptive servers can be plotted side by side.
+ */
+bool RunSweep(const BenchConfig& config) {
+    const unsigned Rates[] = { 1000, 2000, 5000, 10000, 20000 }; // Messages/s offered in total
+    const int DrainMs = 10000;
+
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    unsigned count = config.connections > 0 ? config.connections : 4;
+    vector<BenchConnection> senders(count);
+    deque<Subscriber> subscribers(config.subscribers);
+    for (unsigned i = 0; i < config.subscribers; ++i) {
+        if (!OpenConnection(loop, config, subscribers[i].state, "sub" + to_string(i), "sweep")) {
+            return false;
+        }
+        subscribers[i].Attach();
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (!OpenConnection(loop, config, senders[i], "load" + to_string(i), "sweep")) {
+            return false;
+        }
+    }
+    auto delivered = [&subscribers]() {
+        uint64_t total = 0;
+        for (const Subscriber& subscriber : subscribers) {
+            total += subscriber.delivered;
+        }
+        return total;
+    };
+
+    printf("%u sender(s), %u subscriber(s), %u s per step:\n", count, config.subscribers, config.seconds);
+    printf("  offered/s  delivered/s     p50 us     p99 us   p99.9 us     max us  caught up\n");
+    for (unsigned rate : Rates) {
+        LatencySamples latency;
+        for (Subscriber& subscriber : subscribers) {
+            subscriber.samples = &latency;
+        }
+        uint64_t deliveredBefore = delivered();
+        uint64_t sent = 0;
+        auto start = Clock::now();
+        auto end = start + chrono::seconds(config.seconds);
+        for (Clock::time_point now = start; now < end; now = Clock::now()) {
+            uint64_t due = static_cast<uint64_t>(chrono::duration<double>(now - start).count() * rate);
+            for (; sent < due; ++sent) {
+                loop.Publish(senders[sent % count].connection, StampedText());
+            }
+            loop.RunOnce(1);
+        }
+        uint64_t deliveredInStep = delivered() - deliveredBefore;
+        uint64_t expected = deliveredBefore + sent * config.subscribers;
+        bool caughtUp = RunUntil(loop, [&delivered, expected]() { return delivered() >= expected; }, DrainMs);
+        for (Subscriber& subscriber : subscribers) {
+            subscriber.samples = nullptr;
+        }
+        printf("  %9u  %11.0f  %9.0f  %9.0f  %9.0f  %9.0f  %s\n", rate,
+               deliveredInStep / static_cast<double>(config.seconds) / max(1u, config.subscribers),
+               latency.Percentile(0.5), latency.Percentile(0.99), latency.Percentile(0.999), latency.Percentile(1.0),
+               caughtUp ? "yes" : "no");
+        if (!caughtUp) {
+            break; // Higher rates would only start further behind
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief lanes: control and live chat latency at a reader whose link is full of
+ *        /history pages.
+ *
+ * The reader runs on its own loop that reads at most one receive buffer (16 KB) every
+ * ReadIntervalUs, a link of about 16 MB/s. A chatter publishes ChatRate lines a second
+ * into the room, and the reader publishes a probe line every ProbeIntervalMs and times
+ * its __SENT__ (control lane) while timing the chatter's lines (chat lane). Both are
+ * measured idle, then after the reader asks for HistoryRequests pages (bulk lane) at
+ * once. With the lanes, the loaded times should stay near the idle ones.
+ */
+bool RunLanes(const BenchConfig& config) {
+    const unsigned Backlog = 1000;
+    const unsigned ChatRate = 100;
+    const unsigned HistoryRequests = 2000;
+    const int ReadIntervalUs = 1000;
+    const int ProbeIntervalMs = 10;
+
+    ChatClientLoop loop;
+    ChatClientLoop readerLoop;
+    RouteEvents(loop);
+    RouteEvents(readerLoop);
+
+    BenchConnection chatter;
+    if (!OpenConnection(loop, config, chatter, "chatter", "lanes")) {
+        return false;
+    }
+    unsigned acked = 0;
+    chatter.onEvent = [&acked](const ChatEvent& event) {
+        acked += event.kind == ChatEvent::Sent;
+    };
+    for (unsigned i = 0; i < Backlog; ++i) {
+        loop.Publish(chatter.connection, "backlog line " + to_string(i) + string(150, '.') + " so each page is a few KB");
+    }
+    if (!RunUntil(loop, [&acked]() { return acked == Backlog; }, 10000)) {
+        cerr << "Only " << acked << " of " << Backlog << " backlog messages were acknowledged." << endl;
+        return false;
+    }
+
+    BenchConnection reader;
+    if (!OpenConnection(readerLoop, config, reader, "reader", "lanes")) {
+        return false;
+    }
+    LatencySamples* chat = nullptr;
+    LatencySamples* control = nullptr;
+    Clock::time_point probeSentAt;
+    bool probing = false;
+    uint64_t bulkBytes = 0;
+    reader.onEvent = [&](const ChatEvent& event) {
+        Clock::time_point sentAt;
+        if (event.kind == ChatEvent::Message && chat && (sentAt = StampOf(event)) != Clock::time_point()) {
+            chat->Add(sentAt);
+        } else if (event.kind == ChatEvent::Sent && probing) {
+            if (control) {
+                control->Add(probeSentAt);
+            }
+            probing = false;
+        } else if (event.kind == ChatEvent::History) {
+            bulkBytes += event.lineLength + 1;
+        }
+    };
+
+    for (bool loaded : { false, true }) {
+        LatencySamples chatSamples;
+        LatencySamples controlSamples;
+        chat = &chatSamples;
+        control = &controlSamples;
+        bulkBytes = 0;
+        if (loaded) {
+            for (unsigned i = 0; i < HistoryRequests; ++i) {
+                readerLoop.Command(reader.connection, "/history");
+            }
+        }
+        uint64_t published = 0;
+        auto start = Clock::now();
+        auto end = start + chrono::seconds(config.seconds);
+        Clock::time_point nextProbe = start;
+        Clock::time_point nextRead = start;
+        for (Clock::time_point now = start; now < end; now = Clock::now()) {
+            uint64_t due = static_cast<uint64_t>(chrono::duration<double>(now - start).count() * ChatRate);
+            for (; published < due; ++published) {
+                loop.Publish(chatter.connection, StampedText());
+            }
+            if (!probing && now >= nextProbe) {
+                probeSentAt = now;
+                nextProbe = now + chrono::milliseconds(ProbeIntervalMs);
+                probing = true;
+                readerLoop.Publish(reader.connection, "probe");
+            }
+            if (now >= nextRead) {
+                nextRead = now + chrono::microseconds(ReadIntervalUs);
+                readerLoop.RunOnce(0);
+            }
+            loop.RunOnce(1);
+        }
+        chat = control = nullptr;
+
+        cout << (loaded ? "During " + to_string(HistoryRequests) + " /history pages (" +
+                              to_string(bulkBytes / 1000) + " KB read in " + to_string(config.seconds) + " s):"
+                        : string("Idle:")) << endl;
+        cout << "  control (__SENT__): " << controlSamples.Summary() << endl;
+        cout << "  live chat:          " << chatSamples.Summary() << endl;
+    }
+    return true;
+}
+
+/**
+ * @brief relay: end-to-end latency through a relay tree, and the origin's CPU per
+ *        message.
+ *
+ * Start the origin on --port and the relays with --upstream pointing into the tree and
+ * --channel announce; pass the leaf servers' ports as --leaves. --subscribers
+ * subscribers are spread over the leaves (or all sit on the origin without --leaves)
+ * and a publisher on the origin posts Rate messages a second into #announce. With
+ * --origin-pid the origin's CPU time over the run is divided by the messages posted.
+ * Run it once per tree shape and compare.
+ */
+bool RunRelay(const BenchConfig& config) {
+    const unsigned Rate = 100;
+    const int DrainMs = 10000;
+    const string Channel = "announce";
+
+    ChatClientLoop loop;
+    RouteEvents(loop);
+
+    deque<Subscriber> subscribers(config.subscribers);
+    LatencySamples latency;
+    for (unsigned i = 0; i < config.subscribers; ++i) {
+        BenchConfig leaf = config;
+        if (!config.leaves.empty()) {
+            leaf.port = config.leaves[i % config.leaves.size()];
+        }
+        if (!OpenConnection(loop, leaf, subscribers[i].state, "listener" + to_string(i), Channel)) {
+            return false;
+        }
+        subscribers[i].samples = &latency;
+        subscribers[i].Attach();
+    }
+    BenchConnection publisher;
+    if (!OpenConnection(loop, config, publisher, "announcer", Channel)) {
+        return false;
+    }
+    HANDLE origin = nullptr;
+    if (config.originPid != 0) {
+        origin = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, config.originPid);
+        if (origin == nullptr) {
+            cerr << "Cannot open origin process " << config.originPid << ". Error: " << GetLastError() << endl;
+            return false;
+        }
+    }
+    auto delivered = [&subscribers]() {
+        uint64_t total = 0;
+        for (const Subscriber& subscriber : subscribers) {
+            total += subscriber.delivered;
+        }
+        return total;
+    };
+
+    double originStart = origin ? ProcessCpuSeconds(origin) : 0;
+    uint64_t sent = 0;
+    auto start = Clock::now();
+    auto end = start + chrono::seconds(config.seconds);
+    for (Clock::time_point now = start; now < end; now = Clock::now()) {
+        uint64_t due = static_cast<uint64_t>(chrono::duration<double>(now - start).count() * Rate);
+        for (; sent < due; ++sent) {
+            loop.Publish(publisher.connection, StampedText());
+        }
+        loop.RunOnce(1);
+    }
+    uint64_t expected = sent * config.subscribers;
+    RunUntil(loop, [&delivered, expected]() { return delivered() >= expected; }, DrainMs);
+    double originCpu = origin ? ProcessCpuSeconds(origin) - originStart : 0;
+    chrono::duration<double> elapsed = Clock::now() - start;
+
+    cout << config.subscribers << " subscriber(s) on " << max<size_t>(1, config.leaves.size()) << " server(s), "
+         << sent << " message(s) at " << Rate << "/s: " << delivered() << " of " << expected << " delivered." << endl;
+    cout << "End-to-end latency: " << latency.Summary() << endl;
+    if (origin) {
+        printf("Origin CPU: %.3f ms per message (%.2f of a core).\n", originCpu * 1000 / max<uint64_t>(1, sent),
+               originCpu / elapsed.count());
+        CloseHandle(origin);
+    }
+    return delivered() == expected;
+}
+
+/**
+ * @brief A named scenario.
+ */
+struct Scenario {
+    const char* name;
+    bool (*run)(const BenchConfig&);
+};
+
+const Scenario Scenarios[] = {
+    { "pool", RunPool },
+    { "throughput", RunThroughput },
+    { "latency", RunLatency },
+    { "catchup", RunCatchUp },
+    { "bots", RunBots },
+    { "sweep", RunSweep },
+    { "lanes", RunLanes },
+    { "relay", RunRelay },
+};
+
+/**
+ * @brief Parses command-line options into a BenchConfig.
+ * @return false (after printing usage) if an option is unknown or malformed.
+ */
+bool ParseArguments(int argc, char* argv[], BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--host" && i + 1 < argc) {
+            config.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = static_cast<unsigned short>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--connections" && i + 1 < argc) {
+            config.connections = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--subscribers" && i + 1 < argc) {
+            config.subscribers = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--leaves" && i + 1 < argc) {
+            string ports = argv[++i];
+            for (size_t start = 0; start < ports.size();) {
+                size_t comma = min(ports.find(',', start), ports.size());
+                config.leaves.push_back(static_cast<unsigned short>(strtoul(ports.substr(start, comma - start).c_str(), nullptr, 10)));
+                start = comma + 1;
+            }
+        } else if (arg == "--origin-pid" && i + 1 < argc) {
+            config.originPid = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        } else if (config.scenario.empty() && arg[0] != '-') {
+            config.scenario = arg;
+        } else {
+            config.scenario.clear();
+            break;
+        }
+    }
+    bool known = false;
+    for (const Scenario& scenario : Scenarios) {
+        known = known || config.scenario == scenario.name;
+    }
+    if (!known || config.seconds == 0) {
+        cerr << "Usage: " << argv[0] << " SCENARIO [--host ADDR] [--port N] [--seconds N] [--connections N]"
+             << " [--subscribers N] [--leaves PORT[,PORT...]] [--origin-pid N]" << endl;
+        cerr << "Scenarios:";
+        for (const Scenario& scenario : Scenarios) {
+            cerr << " " << scenario.name;
+        }
+        cerr << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Entry point for the bench tool.
+ * @return int Exit status code.
+ */
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    if (!ParseArguments(argc, argv, config)) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 1: Initialize Winsock
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "Winsock initialization failed. Error: " << WSAGetLastError() << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Step 2: Run the scenario
+    bool passed = false;
+    for (const Scenario& scenario : Scenarios) {
+        if (config.scenario == scenario.name) {
+            cout << "Scenario " << scenario.name << " against " << config.host << ":" << config.port << "." << endl;
+            passed = scenario.run(config);
+        }
+    }
+
+    WSACleanup();
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
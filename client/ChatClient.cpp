@@ -6,11 +6,28 @@
  * On startup, it sends a connection notification message to the server.
  * The client reads full-line input messages, sends them prefixed with the username,
  * and supports clean termination with "quit" or "exit" commands.
+ * Connection handling, framing and frame parsing live in libchatclient.h; this file
+ * is the interactive front end over it.
+ * Every message is sent as one newline-terminated line. Lines starting with '/' are
+ * commands (/join <room>, /msg <user> <text>, /nick <name>, /edit [id] <text>,
+ * /delete [id]) and are sent without the name prefix; without an id, /edit and
+ * /delete apply to the user's last message. Incoming data is split into lines; chat lines carry a "__MSG__<id> "
+ * prefix that is stripped before display. After each batch of incoming lines the
+ * client reports the newest message id it displayed with "__READ__<id>".
+ * Messages are cached per room in a memory-mapped file; on start (and on /join) the
+ * cached messages are shown at once and the server is only asked for newer ones with
+ * "__SINCE__<id>".
+ * When attached to a console the client runs full-screen: messages on the left, the
+ * room's members (from "__MEMBERS__" frames) on the right and the input line at the
+ * bottom; Page Up / Page Down scroll. With redirected input or output it falls back to
+ * plain line printing.
  *
  * Usage:
  *  - Compile and run.
  *  - Enter your chat name.
  *  - Start typing messages; type "quit" or "exit" to disconnect.
+ *  - ChatClient --bench-render measures the CPU cost of showing 10k incoming messages
+ *    a second, per line and full-screen, then exits.
  *
  * @author
  * @version 1.0
@@ -23,8 +40,22 @@
 #include<thread>
 #include <limits>
 #include <mutex>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <deque>
+#include <algorithm>
+#include "libchatclient.h"
 
 std::mutex printMutex;
+std::atomic<uint64_t> lastSentId(0); // Id the server gave our most recent message
 
 
 #pragma comment(lib, "ws2_32.lib") // Link Winsock library
@@ -40,6 +71,563 @@ bool InitializeWinsock() {
     return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
 }
 
+/**
+ * @brief Recent messages of one room, kept in a fixed-size memory-mapped file so a
+ *        restarted client can show them before the server has sent anything.
+ *
+ * The file is a header followed by 8-byte aligned records {id, kind, length, text}.
+ * Edits and deletes are appended as records of their own and applied when the cache is
+ * rendered. When the file is full, the newer half is moved to the front.
+ * Live messages can arrive before the replay of older ones requested with __SINCE__, so
+ * messages are deduplicated by id rather than by the newest id, and rendered in id order.
+ */
+class HistoryCache {
+public:
+    static const uint64_t CacheBytes = 1 << 20;
+    static const size_t RenderCount = 50; // Messages shown on start
+
+    enum Kind : uint32_t { Message = 1, Edit = 2, Delete = 3 };
+
+    HistoryCache() : file(INVALID_HANDLE_VALUE), mapping(nullptr), view(nullptr) {}
+
+    ~HistoryCache() {
+        Close();
+    }
+
+    /**
+     * @brief Opens (or creates) the cache file for a user's room.
+     */
+    bool Open(const string& user, const string& room) {
+        Close();
+        string directory = "chatcache-" + SafeName(user);
+        CreateDirectoryA(directory.c_str(), nullptr);
+        string path = directory + "/" + SafeName(room) + ".cache";
+
+        file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(CacheBytes), nullptr);
+        view = mapping ? static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, CacheBytes)) : nullptr;
+        if (!view) {
+            Close();
+            return false;
+        }
+        if (memcmp(GetHeader()->magic, CacheMagic, sizeof(GetHeader()->magic)) != 0) {
+            memcpy(GetHeader()->magic, CacheMagic, sizeof(GetHeader()->magic));
+            GetHeader()->used = sizeof(Header);
+            GetHeader()->lastId = 0;
+        }
+        IndexMessages();
+        return true;
+    }
+
+    void Close() {
+        if (view) {
+            UnmapViewOfFile(view);
+            view = nullptr;
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            file = INVALID_HANDLE_VALUE;
+        }
+        messageIds.clear();
+    }
+
+    /**
+     * @brief Newest message id in the cache (0 if empty or closed).
+     */
+    uint64_t LastId() const {
+        return view ? GetHeader()->lastId : 0;
+    }
+
+    /**
+     * @brief Whether a message is already cached.
+     */
+    bool Contains(uint64_t id) const {
+        return messageIds.count(id) != 0;
+    }
+
+    /**
+     * @brief Adds a record. Messages that are already cached are skipped.
+     * @return false if nothing was added.
+     */
+    bool Append(uint32_t kind, uint64_t id, const string& text) {
+        if (!view || (kind == Message && Contains(id))) {
+            return false;
+        }
+        uint64_t size = RecordSize(text.length());
+        if (size > CacheBytes / 2) {
+            return false;
+        }
+        if (GetHeader()->used + size > CacheBytes) {
+            DropOlderHalf();
+        }
+
+        Record* record = reinterpret_cast<Record*>(view + GetHeader()->used);
+        record->id = id;
+        record->kind = kind;
+        record->length = static_cast<uint32_t>(text.length());
+        memcpy(record + 1, text.data(), text.length());
+        GetHeader()->used += size;
+        if (kind == Message) {
+            messageIds.insert(id);
+            GetHeader()->lastId = max(GetHeader()->lastId, id);
+        }
+        return true;
+    }
+
+    /**
+     * @brief The newest RenderCount messages with edits and deletes applied, oldest first.
+     */
+    vector<string> Recent() const {
+        vector<pair<uint64_t, string>> messages;
+        map<uint64_t, size_t> positions;
+        for (uint64_t offset = sizeof(Header); view && offset < GetHeader()->used; ) {
+            const Record* record = reinterpret_cast<const Record*>(view + offset);
+            string text(reinterpret_cast<const char*>(record + 1), record->length);
+            auto position = positions.find(record->id);
+            if (record->kind == Message) {
+                positions[record->id] = messages.size();
+                messages.emplace_back(record->id, move(text));
+            } else if (position != positions.end()) {
+                messages[position->second].second = record->kind == Edit ? "(edited) " + text : string();
+            }
+            offset += RecordSize(record->length);
+        }
+        stable_sort(messages.begin(), messages.end(),
+                    [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b) { return a.first < b.first; });
+
+        vector<string> recent;
+        for (auto it = messages.rbegin(); it != messages.rend() && recent.size() < RenderCount; ++it) {
+            if (!it->second.empty()) {
+                recent.push_back(it->second);
+            }
+        }
+        return vector<string>(recent.rbegin(), recent.rend());
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t used;   // Bytes in use, including this header
+        uint64_t lastId; // Newest cached message
+    };
+
+    struct Record {
+        uint64_t id;
+        uint32_t kind;
+        uint32_t length;
+    };
+
+    static constexpr const char* CacheMagic = "CHATCCH1";
+
+    static uint64_t RecordSize(size_t length) {
+        return (sizeof(Record) + length + 7) & ~uint64_t(7);
+    }
+
+    static string SafeName(const string& name) {
+        string safe = name;
+        for (char& c : safe) {
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+                c = '_';
+            }
+        }
+        return safe;
+    }
+
+    Header* GetHeader() const {
+        return reinterpret_cast<Header*>(view);
+    }
+
+    /**
+     * @brief Moves the records in the newer half of the file to the front.
+     */
+    void DropOlderHalf() {
+        uint64_t used = GetHeader()->used;
+        uint64_t keepFrom = sizeof(Header);
+        while (keepFrom < used && keepFrom < used / 2) {
+            keepFrom += RecordSize(reinterpret_cast<const Record*>(view + keepFrom)->length);
+        }
+        memmove(view + sizeof(Header), view + keepFrom, used - keepFrom);
+        GetHeader()->used = sizeof(Header) + (used - keepFrom);
+        IndexMessages();
+    }
+
+    /**
+     * @brief Rebuilds the set of cached message ids from the file.
+     */
+    void IndexMessages() {
+        messageIds.clear();
+        for (uint64_t offset = sizeof(Header); offset < GetHeader()->used; ) {
+            const Record* record = reinterpret_cast<const Record*>(view + offset);
+            if (record->kind == Message) {
+                messageIds.insert(record->id);
+            }
+            offset += RecordSize(record->length);
+        }
+    }
+
+    HANDLE file;
+    HANDLE mapping;
+    char* view;
+    unordered_set<uint64_t> messageIds; // Ids of the Message records in the file
+};
+
+/**
+ * @brief Full-screen console view: scrollback on the left, member list on the right and
+ *        the input line at the bottom.
+ *
+ * Callers only change the model (lines, members, input) and mark it dirty. A render
+ * thread composes the screen into a back buffer of cells (one byte each) at most MaxFps
+ * times a second, compares it with the front buffer - what the console shows - and
+ * writes only the runs of cells that differ, as one escape-sequence string per frame.
+ * A burst of incoming messages therefore costs one console write per frame instead of
+ * one flush per line.
+ */
+class TerminalUI {
+public:
+    static const int MaxFps = 30;
+    static const int MemberPaneWidth = 18;
+    static const size_t MaxScrollback = 5000; // Lines kept for scrolling back
+
+    TerminalUI() : out(INVALID_HANDLE_VALUE), active(false), dirty(false), scrollOffset(0), memberCount(0), pageRows(1) {}
+
+    ~TerminalUI() {
+        Stop();
+    }
+
+    /**
+     * @brief Switches the console to the alternate screen and starts rendering.
+     * @return false if stdout is not a console with escape-sequence support.
+     */
+    bool Start() {
+        out = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode = 0;
+        if (!GetConsoleMode(out, &mode) || !SetConsoleMode(out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+            return false;
+        }
+        Write("\x1b[?1049h");
+        active = true;
+        dirty = true;
+        renderer = thread(&TerminalUI::RenderLoop, this);
+        return true;
+    }
+
+    /**
+     * @brief Stops rendering and restores the normal screen. Safe to call twice.
+     */
+    void Stop() {
+        if (!active.exchange(false)) {
+            return;
+        }
+        if (renderer.joinable()) {
+            renderer.join();
+        }
+        Write("\x1b[?1049l");
+    }
+
+    bool Active() const {
+        return active;
+    }
+
+    void AddLine(const string& text) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        lines.push_back(text);
+        if (lines.size() > MaxScrollback) {
+            lines.pop_front();
+        }
+        dirty = true;
+    }
+
+    /**
+     * @brief Replaces the member list with the body of a "__MEMBERS__" frame,
+     *        "<count> <name>,<name>,...".
+     */
+    void SetMembers(const string& frame) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        memberCount = strtoull(frame.c_str(), nullptr, 10);
+        members.clear();
+        size_t start = frame.find(' ');
+        while (start != string::npos && start + 1 < frame.length()) {
+            size_t comma = frame.find(',', start + 1);
+            members.push_back(frame.substr(start + 1, comma == string::npos ? string::npos : comma - start - 1));
+            start = comma;
+        }
+        dirty = true;
+    }
+
+    void SetInput(const string& text) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        input = text;
+        dirty = true;
+    }
+
+    /**
+     * @brief Scrolls the message pane by whole pages; positive is back in time.
+     */
+    void ScrollPages(int pages) {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        long long offset = static_cast<long long>(scrollOffset) + static_cast<long long>(pages) * pageRows;
+        scrollOffset = static_cast<size_t>(max(0LL, min(offset, static_cast<long long>(lines.size()))));
+        dirty = true;
+    }
+
+private:
+    void Write(const string& data) {
+        const char* next = data.data();
+        size_t left = data.length();
+        while (left > 0) {
+            DWORD written = 0;
+            if (!WriteConsoleA(out, next, static_cast<DWORD>(left), &written, nullptr) || written == 0) {
+                return;
+            }
+            next += written;
+            left -= written;
+        }
+    }
+
+    static void Put(vector<char>& cells, int width, int row, int column, const string& text, int maxLength) {
+        for (int i = 0; i < maxLength && i < static_cast<int>(text.length()); ++i) {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            cells[row * width + column + i] = c < 32 ? ' ' : static_cast<char>(c);
+        }
+    }
+
+    /**
+     * @brief Draws the current model into cells. Caller holds stateMutex.
+     * @return Column of the input cursor on the bottom row.
+     */
+    int Compose(vector<char>& cells, int width, int height) {
+        int chatWidth = width - MemberPaneWidth - 1;
+        if (chatWidth < 20) {
+            chatWidth = width; // Too narrow for the member pane
+        }
+        int chatRows = height - 2;
+        pageRows = max(1, chatRows - 1);
+
+        // Messages, newest at the bottom, wrapped to the pane width
+        int row = chatRows - 1;
+        size_t skip = scrollOffset;
+        for (size_t i = lines.size(); i-- > 0 && row >= 0;) {
+            const string& line = lines[i];
+            size_t wrapped = line.empty() ? 1 : (line.length() + chatWidth - 1) / chatWidth;
+            for (size_t part = wrapped; part-- > 0 && row >= 0;) {
+                if (skip > 0) {
+                    --skip;
+                    continue;
+                }
+                Put(cells, width, row--, 0, line.substr(part * chatWidth, chatWidth), chatWidth);
+            }
+        }
+
+        if (chatWidth < width) {
+            int paneColumn = chatWidth + 1;
+            for (int r = 0; r < chatRows; ++r) {
+                cells[r * width + chatWidth] = '|';
+            }
+            Put(cells, width, 0, paneColumn, "Members (" + to_string(memberCount) + ")", MemberPaneWidth);
+            size_t shown = min(members.size(), static_cast<size_t>(max(0, chatRows - 1)));
+            if (shown < memberCount && shown > 0) {
+                --shown; // Leave the last row for the "+N more" line
+                Put(cells, width, static_cast<int>(shown) + 1, paneColumn, "+" + to_string(memberCount - shown) + " more", MemberPaneWidth);
+            }
+            for (size_t i = 0; i < shown; ++i) {
+                Put(cells, width, static_cast<int>(i) + 1, paneColumn, members[i], MemberPaneWidth);
+            }
+        }
+
+        int ruleRow = height - 2;
+        fill(cells.begin() + ruleRow * width, cells.begin() + (ruleRow + 1) * width, '-');
+        if (scrollOffset > 0) {
+            Put(cells, width, ruleRow, 2, " scrolled back " + to_string(scrollOffset) + " line(s) ", width - 2);
+        }
+
+        // Input line; when longer than the screen its tail stays visible
+        size_t visible = static_cast<size_t>(max(1, width - 3));
+        string shownInput = input.length() > visible ? input.substr(input.length() - visible) : input;
+        Put(cells, width, height - 1, 0, "> " + shownInput, width);
+        return static_cast<int>(min(shownInput.length() + 2, static_cast<size_t>(width - 1)));
+    }
+
+    void RenderLoop() {
+        const int MergeGap = 6; // Rewriting a few equal cells is cheaper than a new cursor move
+        vector<char> back, front;
+        int frontWidth = 0, frontHeight = 0;
+
+        while (active) {
+            this_thread::sleep_for(std::chrono::milliseconds(1000 / MaxFps));
+            CONSOLE_SCREEN_BUFFER_INFO info;
+            if (!GetConsoleScreenBufferInfo(out, &info)) {
+                continue;
+            }
+            int width = info.srWindow.Right - info.srWindow.Left + 1;
+            int height = info.srWindow.Bottom - info.srWindow.Top + 1;
+            bool resized = width != frontWidth || height != frontHeight;
+            if (!dirty.exchange(false) && !resized) {
+                continue;
+            }
+            if (width < 4 || height < 3) {
+                continue;
+            }
+
+            back.assign(static_cast<size_t>(width) * height, ' ');
+            int cursorColumn;
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                cursorColumn = Compose(back, width, height);
+            }
+
+            string frame;
+            if (resized) {
+                front.assign(back.size(), '\0'); // Matches no cell, so everything is redrawn
+                frontWidth = width;
+                frontHeight = height;
+                frame = "\x1b[2J";
+            }
+            for (int row = 0; row < height; ++row) {
+                const char* next = &back[static_cast<size_t>(row) * width];
+                const char* shown = &front[static_cast<size_t>(row) * width];
+                int column = 0;
+                while (column < width) {
+                    if (next[column] == shown[column]) {
+                        ++column;
+                        continue;
+                    }
+                    int start = column;
+                    int end = column + 1;
+                    for (int probe = end; probe < width && probe - end <= MergeGap; ++probe) {
+                        if (next[probe] != shown[probe]) {
+                            end = probe + 1;
+                        }
+                    }
+                    frame += "\x1b[" + to_string(row + 1) + ";" + to_string(start + 1) + "H";
+                    frame.append(next + start, end - start);
+                    column = end;
+                }
+            }
+            front.swap(back);
+            frame += "\x1b[" + to_string(height) + ";" + to_string(cursorColumn + 1) + "H";
+            Write(frame);
+        }
+    }
+
+    HANDLE out;
+    std::atomic<bool> active;
+    std::atomic<bool> dirty;        // Model changed since the last frame
+    thread renderer;
+
+    std::mutex stateMutex;          // Guards everything below
+    deque<string> lines;
+    size_t scrollOffset;            // Wrapped rows hidden below the bottom of the pane
+    vector<string> members;
+    size_t memberCount;
+    string input;
+    int pageRows;
+};
+
+TerminalUI ui;
+
+/**
+ * @brief Shows one line: in the message pane when full-screen, otherwise printed on its
+ *        own line followed by a fresh input prompt.
+ */
+void Display(const string& text) {
+    if (ui.Active()) {
+        ui.AddLine(text);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(printMutex);
+    cout << "\n" << text << endl;  // Print incoming message on new line
+    cout << "Send your message: ";   // Re-print prompt for user input
+    cout.flush();
+}
+
+/**
+ * @brief Reads one line of keyboard input in full-screen mode, echoing it on the input
+ *        row. Page Up / Page Down scroll the message pane.
+ * @return false if console input cannot be read.
+ */
+bool ReadInputLine(string& line) {
+    HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+    line.clear();
+    ui.SetInput(line);
+    while (true) {
+        INPUT_RECORD record;
+        DWORD count = 0;
+        if (!ReadConsoleInputA(in, &record, 1, &count)) {
+            return false;
+        }
+        if (count == 0 || record.EventType != KEY_EVENT || !record.Event.KeyEvent.bKeyDown) {
+            continue;
+        }
+        const KEY_EVENT_RECORD& key = record.Event.KeyEvent;
+        if (key.wVirtualKeyCode == VK_RETURN) {
+            ui.SetInput(string());
+            return true;
+        } else if (key.wVirtualKeyCode == VK_PRIOR || key.wVirtualKeyCode == VK_NEXT) {
+            ui.ScrollPages(key.wVirtualKeyCode == VK_PRIOR ? 1 : -1);
+            continue;
+        } else if (key.wVirtualKeyCode == VK_BACK) {
+            if (!line.empty()) line.pop_back();
+        } else if (static_cast<unsigned char>(key.uChar.AsciiChar) >= 32) {
+            line += key.uChar.AsciiChar;
+        } else {
+            continue;
+        }
+        ui.SetInput(line);
+    }
+}
+
+std::mutex cacheMutex;
+HistoryCache historyCache; // Cache of the room we are in; guarded by cacheMutex
+
+/**
+ * @brief Switches the cache to a room, shows what it holds and asks the server for
+ *        newer messages only.
+ */
+void OpenRoomCache(ChatClientLoop& loop, ChatConnection* server, const string& room) {
+    string name = server->Name();
+    auto openedAt = std::chrono::steady_clock::now();
+    vector<string> cached;
+    uint64_t lastCachedId = 0;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (historyCache.Open(name, room)) {
+            cached = historyCache.Recent();
+            lastCachedId = historyCache.LastId();
+        }
+    }
+    if (!cached.empty()) {
+        if (ui.Active()) {
+            for (const string& text : cached) {
+                ui.AddLine(text);
+            }
+        } else {
+            std::lock_guard<std::mutex> lock(printMutex);
+            for (const string& text : cached) {
+                cout << text << "\n";
+            }
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - openedAt;
+        string summary = "(" + to_string(cached.size()) + " cached message(s) from #" + room + ", shown in " +
+                         to_string(elapsed.count()) + " ms)";
+        if (ui.Active()) {
+            ui.AddLine(summary);
+        } else {
+            std::lock_guard<std::mutex> lock(printMutex);
+            cout << summary << endl;
+        }
+    }
+
+    loop.Since(server, lastCachedId);
+}
+
 /**
  * @brief Handles sending messages to the server from the client.
  *
@@ -47,7 +635,8 @@ bool InitializeWinsock() {
  * Then enters a loop to read user input and send messages prefixed with the chat name.
  * Exits cleanly when user types "quit" or "exit".
  *
- * @param clientSocket Connected socket to the chat server.
+ * @param loop Loop that owns the connection.
+ * @param server Connection to the chat server.
  */
 
 /*
@@ -92,55 +681,222 @@ void sendMesg(SOCKET s) {
 }
 */
 
-void sendMesg(SOCKET s) {
+std::mutex serverMutex;
+bool serverOpen = true; // Cleared by OnClosed; the loop frees the connection right after
+
+void sendMesg(ChatClientLoop& loop, ChatConnection* server) {
     string name;
     do {
-        std::lock_guard<std::mutex> lock(printMutex);
-        cout << "Enter your chat name: ";
-        getline(cin >> ws, name);
+        {
+            std::lock_guard<std::mutex> lock(printMutex);
+            cout << "Enter your chat name: ";
+            cout.flush();
+        }
+        getline(cin >> ws, name); // Not under printMutex, or the receive thread would stall
     } while (name.empty());
 
-    string connectMsg = "__CONNECT__" + name;
-    send(s, connectMsg.c_str(), (int)connectMsg.length(), 0);
+    bool fullScreen = ui.Start();
+    {
+        std::lock_guard<std::mutex> lock(serverMutex);
+        if (serverOpen) {
+            loop.SignIn(server, name);
+            OpenRoomCache(loop, server, "lobby");
+        }
+    }
 
     string message;
     while (true) {
-        {
-            std::lock_guard<std::mutex> lock(printMutex);
-            cout << "Send your message: ";
-            cout.flush();
+        if (fullScreen) {
+            if (!ReadInputLine(message)) break;
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(printMutex);
+                cout << "Send your message: ";
+                cout.flush();
+            }
+            getline(cin, message);
         }
-        getline(cin, message);
         if (message.empty()) continue;
 
-        string fullMsg = name + " : " + message;
-        int byteSent = send(s, fullMsg.c_str(), (int)fullMsg.length(), 0);
+        // /edit and /delete default to our last message
+        if (message == "/delete") {
+            message += " " + to_string(lastSentId.load());
+        } else if (message.compare(0, 6, "/edit ") == 0 && !isdigit(static_cast<unsigned char>(message[6]))) {
+            message = "/edit " + to_string(lastSentId.load()) + message.substr(5);
+        }
 
-        if (byteSent == SOCKET_ERROR) {
+        // Commands go to the server as typed; chat is prefixed with the sender's name
+        bool sent;
+        {
+            std::lock_guard<std::mutex> lock(serverMutex);
+            if (!serverOpen) break; // Already reported by OnClosed
+            if (message.compare(0, 6, "/nick ") == 0 && message.length() > 6) {
+                sent = loop.Nick(server, message.substr(6));
+            } else if (message[0] == '/') {
+                sent = loop.Command(server, message);
+            } else {
+                sent = loop.Publish(server, message);
+            }
+        }
+
+        if (!sent) {
+            ui.Stop();
             std::lock_guard<std::mutex> lock(printMutex);
             cerr << "\nError sending message." << endl;
             break;
         }
         if (message == "quit" || message == "exit") {
+            ui.Stop();
             std::lock_guard<std::mutex> lock(printMutex);
             cout << "\nStopping the application." << endl;
             break;
         }
     }
-    closesocket(s);
-    WSACleanup();
+    ui.Stop();
+    loop.Stop();
 }
 
 
 
 
 /**
- * @brief Handles receiving messages from the server.
+ * @brief Turns one line from the server into display text.
+ *
+ * Chat messages arrive as "__MSG__<id> <text>"; the id is recorded in lastSeenId.
+ * "__ROOM__<name>" confirms a /join; "__HIST__<id> [time] <text>" is one line of a
+ * /history page; "__MENTION__<id> #<room> <text>" is a message that mentions us;
+ * "__REACT__<id> <emoji> <count>" is an aggregated reaction count;
+ * "__REPLY__<id> <parent id> <text>" is a reply in a thread we take part in or follow,
+ * and "__THREAD__<id> <replies> <last reply> <participants>" heads a /thread page;
+ * "__EDIT__<id> <text>" and "__DELETE__<id>" report changes to earlier
+ * messages. "__SENT__<id>" (the id of our own message) and "__SEEN__"
+ * read-receipt counts are not shown.
+ * Anything else (system notices) is shown as-is.
+ *
+ * @param line One newline-delimited line from the server.
+ * @param lastSeenId Updated with the id of the last chat message seen.
+ * @return Text to display, or an empty string if nothing should be shown.
+ */
+string FormatIncoming(const string& line, uint64_t& lastSeenId) {
+    const string seenPrefix = "__SEEN__";
+    if (line.compare(0, seenPrefix.length(), seenPrefix) == 0) {
+        return string();
+    }
+
+    const string sentPrefix = "__SENT__";
+    if (line.compare(0, sentPrefix.length(), sentPrefix) == 0) {
+        lastSentId = strtoull(line.c_str() + sentPrefix.length(), nullptr, 10);
+        return string();
+    }
+
+    const string roomPrefix = "__ROOM__";
+    if (line.compare(0, roomPrefix.length(), roomPrefix) == 0) {
+        return "You are now in #" + line.substr(roomPrefix.length());
+    }
+
+    const string editPrefix = "__EDIT__";
+    if (line.compare(0, editPrefix.length(), editPrefix) == 0) {
+        size_t space = line.find(' ');
+        return space == string::npos ? line : "(edited) " + line.substr(space + 1);
+    }
+
+    const string deletePrefix = "__DELETE__";
+    if (line.compare(0, deletePrefix.length(), deletePrefix) == 0) {
+        return "(message " + line.substr(deletePrefix.length()) + " deleted)";
+    }
+
+    const string replyPrefix = "__REPLY__";
+    if (line.compare(0, replyPrefix.length(), replyPrefix) == 0) {
+        size_t parent = line.find(' ');
+        size_t text = parent == string::npos ? string::npos : line.find(' ', parent + 1);
+        if (text == string::npos) {
+            return line;
+        }
+        return "[reply " + line.substr(replyPrefix.length(), parent - replyPrefix.length()) + " to " +
+               line.substr(parent + 1, text - parent - 1) + "] " + line.substr(text + 1);
+    }
+
+    const string threadPrefix = "__THREAD__";
+    if (line.compare(0, threadPrefix.length(), threadPrefix) == 0) {
+        unsigned long long parent = 0, replies = 0, lastReply = 0, participants = 0;
+        sscanf(line.c_str() + threadPrefix.length(), "%llu %llu %llu %llu", &parent, &replies, &lastReply, &participants);
+        return "Thread " + to_string(parent) + ": " + to_string(replies) + " replies, " +
+               to_string(participants) + " participants";
+    }
+
+    const string reactPrefix = "__REACT__";
+    if (line.compare(0, reactPrefix.length(), reactPrefix) == 0) {
+        size_t emoji = line.find(' ');
+        size_t count = line.rfind(' ');
+        if (emoji == string::npos || count == emoji) {
+            return line;
+        }
+        return "(message " + line.substr(reactPrefix.length(), emoji - reactPrefix.length()) + ": " +
+               line.substr(emoji + 1, count - emoji - 1) + " x" + line.substr(count + 1) + ")";
+    }
+
+    const string mentionPrefix = "__MENTION__";
+    if (line.compare(0, mentionPrefix.length(), mentionPrefix) == 0) {
+        size_t space = line.find(' ');
+        return space == string::npos ? line : "[mentioned in] " + line.substr(space + 1);
+    }
+
+    const string historyPrefix = "__HIST__";
+    if (line.compare(0, historyPrefix.length(), historyPrefix) == 0) {
+        return "#" + line.substr(historyPrefix.length()); // Keep the id visible for "/history before <id>"
+    }
+
+    const string msgPrefix = "__MSG__";
+    if (line.compare(0, msgPrefix.length(), msgPrefix) != 0) {
+        return line;
+    }
+    size_t space = line.find(' ', msgPrefix.length());
+    if (space == string::npos) {
+        return line;
+    }
+    lastSeenId = strtoull(line.c_str() + msgPrefix.length(), nullptr, 10);
+    return line.substr(space + 1);
+}
+
+/**
+ * @brief Records chat, edit and delete frames in the room cache, and switches caches
+ *        when the server confirms a /join.
+ * @return false if the line is a message that was already cached (and shown).
+ */
+bool CacheIncoming(ChatClientLoop& loop, ChatConnection& server, const ChatEvent& event) {
+    uint32_t kind;
+    switch (event.kind) {
+    case ChatEvent::Room:
+        OpenRoomCache(loop, &server, event.Text());
+        return true;
+    case ChatEvent::Message:
+        kind = HistoryCache::Message;
+        break;
+    case ChatEvent::Edit:
+        kind = HistoryCache::Edit;
+        break;
+    case ChatEvent::Delete:
+        kind = HistoryCache::Delete;
+        break;
+    default:
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    bool duplicate = kind == HistoryCache::Message && historyCache.Contains(event.id); // Replay may follow newer live messages
+    historyCache.Append(kind, event.id, event.Text());
+    return !duplicate;
+}
+
+/**
+ * @brief Handles one line received from the server.
  *
- * Continuously listens for messages from the server and prints them to console.
- * Terminates when the connection is closed or an error occurs.
+ * Called by the client loop for every line; shows it unless it is a duplicate or a
+ * control frame.
  *
- * @param clientSocket Connected socket to the chat server.
+ * @param loop Loop that owns the connection.
+ * @param server Connection the line arrived on.
+ * @param event The parsed line; only valid during the call.
  */
 
 /*
@@ -165,37 +921,97 @@ void recvMesg(SOCKET clientSocket) {
 
 */
 
-void recvMesg(SOCKET s) {
-    char buffer[4096];
-    while (true) {
-        int recvLen = recv(s, buffer, sizeof(buffer) - 1, 0);
-        if (recvLen <= 0) {
-            std::lock_guard<std::mutex> lock(printMutex);
-            cout << "\nDisconnected from server." << endl;
-            break;
-        }
-        buffer[recvLen] = '\0'; // Null terminate safely
+uint64_t lastSeenId = 0;   // Newest message shown; client loop thread only
+uint64_t lastReadSent = 0; // Newest id reported to the server
 
-        {
-            std::lock_guard<std::mutex> lock(printMutex);
-            cout << "\n" << buffer << endl;  // Print incoming message on new line
-            cout << "Send your message: ";   // Re-print prompt for user input
-            cout.flush();
+void recvMesg(ChatClientLoop& loop, ChatConnection& server, const ChatEvent& event) {
+    if (event.kind == ChatEvent::Members) {
+        ui.SetMembers(to_string(event.id) + " " + event.Text()); // Only drawn full-screen
+        return;
+    }
+    if (!CacheIncoming(loop, server, event)) return;
+    string text = FormatIncoming(event.Line(), lastSeenId);
+    if (!text.empty()) Display(text);
+}
+
+/**
+ * @brief Sends one read receipt per batch of received lines, not per message.
+ */
+void ReportRead(ChatClientLoop& loop, ChatConnection& server) {
+    if (lastSeenId != lastReadSent) {
+        loop.MarkRead(&server, lastSeenId);
+        lastReadSent = lastSeenId;
+    }
+}
+
+/**
+ * @brief CPU time (user + kernel) this process has used so far, in seconds.
+ */
+double ProcessCpuSeconds() {
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    auto ticks = [](const FILETIME& time) {
+        return (static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime; // 100 ns units
+    };
+    return (ticks(kernel) + ticks(user)) / 1e7;
+}
+
+/**
+ * @brief --bench-render: CPU used to show 10k incoming messages a second, printed line
+ *        by line (as with redirected output) and then through the full-screen view.
+ *
+ * Run it in a console; both modes draw there and the results follow at the end. The
+ * console's own cost of drawing what it is sent is not included.
+ */
+int RunRenderBench() {
+    const unsigned MessagesPerSecond = 10000;
+    const unsigned Seconds = 5;
+    const unsigned PerMillisecond = MessagesPerSecond / 1000;
+
+    auto feed = []() {
+        double cpuStart = ProcessCpuSeconds();
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned ms = 0; ms < Seconds * 1000; ++ms) {
+            for (unsigned i = 0; i < PerMillisecond; ++i) {
+                Display("bench" + to_string(i) + " : incoming message " + to_string(ms * PerMillisecond + i) +
+                        " of the render benchmark");
+            }
+            this_thread::sleep_until(start + std::chrono::milliseconds(ms + 1));
         }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return make_pair((ProcessCpuSeconds() - cpuStart) / elapsed.count(), elapsed.count());
+    };
+
+    pair<double, double> perLine = feed();
+    if (!ui.Start()) {
+        cerr << "The full-screen view needs a console; run --bench-render in one." << endl;
+        return 1;
     }
-    closesocket(s);
-    WSACleanup();
+    pair<double, double> fullScreen = feed();
+    ui.Stop();
+
+    printf("%u messages/s for %u s (CPU seconds per second of traffic):\n", MessagesPerSecond, Seconds);
+    printf("  printed per line:  %.3f (%u messages took %.1f s)\n", perLine.first, MessagesPerSecond * Seconds,
+           perLine.second);
+    printf("  full-screen view:  %.3f (%u messages took %.1f s, at most %d frames/s)\n", fullScreen.first,
+           MessagesPerSecond * Seconds, fullScreen.second, TerminalUI::MaxFps);
+    return 0;
 }
 
 /**
  * @brief Main entry point for the chat client.
  *
- * Initializes Winsock, creates socket, connects to server,
- * then starts send and receive threads.
+ * Initializes Winsock, connects to the server through the client loop,
+ * then starts the input thread and the loop thread.
  *
  * @return int Exit status code.
  */
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--bench-render") {
+        return RunRenderBench();
+    }
     if (!InitializeWinsock()) {
         cerr << "Error initializing Winsock." << endl;
         return 1;
@@ -203,36 +1019,46 @@ int main() {
 
     cout << "Client started" << endl;
 
-    // Create TCP socket
-    SOCKET clientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (clientSocket == INVALID_SOCKET) {
+    const int ConnectTimeoutMs = 10000;
+
+    // Create the connection; the loop does the non-blocking connect
+    ChatClientLoop loop;
+    ChatConnection* server = loop.Connect("127.0.0.1", 12345);
+    if (server == nullptr) {
         cerr << "Socket creation failed with error: " << WSAGetLastError() << endl;
         WSACleanup();
         return 1;
     }
-
-    // Server address setup
-    sockaddr_in serverAddr;
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(12345);
-    inet_pton(AF_INET, "127.0.0.1", &serverAddr.sin_addr);
-
-    // Connect to server
-    if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
-        cerr << "Unable to connect to server. Error: " << WSAGetLastError() << endl;
-        closesocket(clientSocket);
+    if (!loop.WaitConnected(server, ConnectTimeoutMs)) {
+        cerr << "Unable to connect to server." << endl;
         WSACleanup();
         return 1;
     }
 
     cout << "Successfully connected to server" << endl;
 
-    // Launch sender and receiver threads
-    thread sender(sendMesg, clientSocket);
-    thread receiver(recvMesg, clientSocket);
+    loop.OnMessage([&loop](ChatConnection& connection, const ChatEvent& event) {
+        recvMesg(loop, connection, event);
+    });
+    loop.OnBatchEnd([&loop](ChatConnection& connection) {
+        ReportRead(loop, connection);
+    });
+    loop.OnClosed([&loop](ChatConnection&) {
+        {
+            std::lock_guard<std::mutex> lock(serverMutex);
+            serverOpen = false;
+        }
+        Display("Disconnected from server.");
+        loop.Stop();
+    });
+
+    // Launch the input thread; the receiver thread runs the client loop
+    thread sender(sendMesg, std::ref(loop), server);
+    thread receiver(&ChatClientLoop::Run, &loop);
 
     sender.join();
     receiver.join();
+    WSACleanup();
 
     return 0;
 }
@@ -0,0 +1,494 @@
+/**
+ * @file libchatclient.h
+ * @brief Embeddable chat client: the connection handshake, line framing and frame
+ *        parsing of ChatClient.cpp, driven by a poll loop that can own many connections.
+ *
+ * One ChatClientLoop runs on one thread and serves any number of connections through
+ * WSAPoll. Outgoing calls (SignIn, Join, Publish, PublishBatch, Command, ...) may be
+ * made from any thread: they append to the connection's outbound buffer and try to send
+ * at once, and whatever the socket does not take is flushed by the loop when it becomes
+ * writable. Incoming data is split into lines in the connection's receive buffer and
+ * handed to the OnMessage callback as ChatEvent views into that buffer, so nothing is
+ * copied; a view is only valid until the callback returns. A connection is freed by
+ * the loop once its OnClosed callback has returned, so other threads that send on it
+ * must stop before that callback finishes.
+ *
+ * Typical bot:
+ *  - ChatClientLoop loop; loop.OnMessage(...);
+ *  - ChatConnection* c = loop.Connect("127.0.0.1", 12345); loop.SignIn(c, "bot");
+ *  - loop.Join(c, "alerts"); loop.Publish(c, "hello");
+ *  - loop.Run();   // until Stop()
+ *
+ * The caller initializes Winsock (WSAStartup) before using the loop.
+ *
+ * @author
+ * @version 1.0
+ */
+
+#pragma once
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#pragma comment(lib, "ws2_32.lib") // Link Winsock library
+
+/**
+ * @brief One line received from the server, parsed in place.
+ *
+ * Lines of the form "__KIND__<id> <text>" fill kind, id and text. For Room the text is
+ * the room name, for Members the id is the member count. Anything else is a Notice
+ * whose text is the whole line. All pointers refer to the receive buffer.
+ */
+struct ChatEvent {
+    enum Kind {
+        Notice, Message, Sent, Seen, Room, Edit, Delete, Reply, Thread, React, Mention, History, Members
+    };
+
+    Kind kind;
+    uint64_t id;
+    const char* text;
+    size_t textLength;
+    const char* line;      // Whole line without the newline
+    size_t lineLength;
+
+    std::string Text() const {
+        return std::string(text, textLength);
+    }
+
+    std::string Line() const {
+        return std::string(line, lineLength);
+    }
+
+    /**
+     * @brief Parses one line; never fails, unknown lines become notices.
+     */
+    static ChatEvent Parse(const char* line, size_t length) {
+        static const struct { const char* prefix; Kind kind; } Prefixes[] = {
+            { "__MSG__", Message }, { "__SENT__", Sent }, { "__SEEN__", Seen }, { "__ROOM__", Room },
+            { "__EDIT__", Edit }, { "__DELETE__", Delete }, { "__REPLY__", Reply },
+            { "__THREAD__", Thread }, { "__REACT__", React }, { "__MENTION__", Mention },
+            { "__HIST__", History }, { "__MEMBERS__", Members },
+        };
+
+        ChatEvent event = { Notice, 0, line, length, line, length };
+        if (length < 4 || line[0] != '_' || line[1] != '_') {
+            return event;
+        }
+        for (const auto& entry : Prefixes) {
+            size_t prefixLength = strlen(entry.prefix);
+            if (length < prefixLength || memcmp(line, entry.prefix, prefixLength) != 0) {
+                continue;
+            }
+            size_t pos = prefixLength;
+            while (pos < length && line[pos] >= '0' && line[pos] <= '9') {
+                event.id = event.id * 10 + static_cast<uint64_t>(line[pos++] - '0');
+            }
+            if (pos < length && line[pos] == ' ') {
+                ++pos;
+            }
+            event.kind = entry.kind;
+            event.text = line + pos;
+            event.textLength = length - pos;
+            return event;
+        }
+        return event;
+    }
+};
+
+/**
+ * @brief One server connection owned by a ChatClientLoop.
+ */
+class ChatConnection {
+public:
+    enum State { Connecting, Open, Closed };
+
+    State GetState() const {
+        return state;
+    }
+
+    std::string Name() const {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        return name;
+    }
+
+    void* userData = nullptr; // Free for the application, e.g. a bot's per-connection state
+
+private:
+    friend class ChatClientLoop;
+
+    explicit ChatConnection(SOCKET socket) : socket(socket), state(Connecting), closing(false), received(0) {
+        inbox.resize(InitialInboxBytes);
+    }
+
+    static const size_t InitialInboxBytes = 16 * 1024;
+
+    SOCKET socket;
+    std::atomic<State> state;
+    std::atomic<bool> closing;     // Disconnect() requested; close once the outbox is sent
+
+    std::vector<char> inbox;       // Loop thread only
+    size_t received;               // Bytes of inbox in use
+
+    mutable std::mutex sendMutex;  // Guards name and outbox
+    std::string name;
+    std::string outbox;            // Bytes the socket has not taken yet
+};
+
+/**
+ * @brief Poll loop for any number of chat connections.
+ */
+class ChatClientLoop {
+public:
+    typedef std::function<void(ChatConnection&, const ChatEvent&)> MessageHandler;
+    typedef std::function<void(ChatConnection&)> ConnectionHandler;
+
+    ChatClientLoop() : stopping(false) {}
+
+    ~ChatClientLoop() {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto& connection : connections) {
+            if (connection->state != ChatConnection::Closed) {
+                closesocket(connection->socket);
+            }
+        }
+    }
+
+    /** @brief Called for every line received, on the loop thread. */
+    void OnMessage(MessageHandler handler) {
+        onMessage = handler;
+    }
+
+    /** @brief Called after the lines of one recv() have been delivered. */
+    void OnBatchEnd(ConnectionHandler handler) {
+        onBatchEnd = handler;
+    }
+
+    /**
+     * @brief Called once when a connection fails, the server closes it or Disconnect()
+     *        closes it. The loop frees the connection at the end of that RunOnce(), so
+     *        this is the last moment the pointer may be used; drop every copy of it here.
+     */
+    void OnClosed(ConnectionHandler handler) {
+        onClosed = handler;
+    }
+
+    /**
+     * @brief Starts a non-blocking connect to host:port.
+     * @return The connection, or nullptr if the socket could not be created.
+     */
+    ChatConnection* Connect(const std::string& host, unsigned short port) {
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (s == INVALID_SOCKET) {
+            return nullptr;
+        }
+        u_long nonBlocking = 1;
+        ioctlsocket(s, FIONBIO, &nonBlocking);
+        BOOL noDelay = TRUE;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+
+        sockaddr_in serverAddr;
+        memset(&serverAddr, 0, sizeof(serverAddr));
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr);
+
+        std::unique_ptr<ChatConnection> connection(new ChatConnection(s));
+        if (connect(s, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                closesocket(s);
+                return nullptr;
+            }
+        } else {
+            connection->state = ChatConnection::Open;
+        }
+
+        ChatConnection* result = connection.get();
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.push_back(std::move(connection));
+        return result;
+    }
+
+    /**
+     * @brief Runs the loop until the connection is established or has failed.
+     *        Only for front ends that have not started Run() on another thread.
+     */
+    bool WaitConnected(ChatConnection* connection, int timeoutMs) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (connection->state == ChatConnection::Connecting && std::chrono::steady_clock::now() < deadline) {
+            RunOnce(10);
+        }
+        return connection->state == ChatConnection::Open;
+    }
+
+    /** @brief Announces the chat name ("__CONNECT__"); chat lines are sent under it. */
+    bool SignIn(ChatConnection* connection, const std::string& name) {
+        {
+            std::lock_guard<std::mutex> lock(connection->sendMutex);
+            connection->name = name;
+        }
+        return Write(connection, "__CONNECT__" + name + "\n");
+    }
+
+    bool Join(ChatConnection* connection, const std::string& room) {
+        return Write(connection, "/join " + room + "\n");
+    }
+
+    /** @brief Renames the connection; later chat lines are sent under the new name. */
+    bool Nick(ChatConnection* connection, const std::string& name) {
+        {
+            std::lock_guard<std::mutex> lock(connection->sendMutex);
+            connection->name = name;
+        }
+        return Write(connection, "/nick " + name + "\n");
+    }
+
+    /** @brief Sends one chat line to the current room. */
+    bool Publish(ChatConnection* connection, const std::string& text) {
+        return Write(connection, Prefix(connection) + text + "\n");
+    }
+
+    /** @brief Sends several chat lines with a single send(). */
+    bool PublishBatch(ChatConnection* connection, const std::vector<std::string>& texts) {
+        std::string prefix = Prefix(connection);
+        std::string frames;
+        size_t bytes = 0;
+        for (const std::string& text : texts) {
+            bytes += prefix.length() + text.length() + 1;
+        }
+        frames.reserve(bytes);
+        for (const std::string& text : texts) {
+            frames += prefix;
+            frames += text;
+            frames += '\n';
+        }
+        return Write(connection, frames);
+    }
+
+    /** @brief Sends a slash command (or any raw line) as typed. */
+    bool Command(ChatConnection* connection, const std::string& line) {
+        return Write(connection, line + "\n");
+    }
+
+    /** @brief Asks for the messages of the current room after id ("__SINCE__"). */
+    bool Since(ChatConnection* connection, uint64_t id) {
+        return Write(connection, "__SINCE__" + std::to_string(id) + "\n");
+    }
+
+    /** @brief Reports the newest message id shown to the user ("__READ__"). */
+    bool MarkRead(ChatConnection* connection, uint64_t id) {
+        return Write(connection, "__READ__" + std::to_string(id) + "\n");
+    }
+
+    /**
+     * @brief Closes the connection once everything queued on it has been sent.
+     *        Call from the loop thread, or while no thread is running the loop.
+     */
+    void Disconnect(ChatConnection* connection) {
+        connection->closing = true;
+        if (connection->state == ChatConnection::Open && !HasOutbox(connection)) {
+            Close(connection);
+        }
+    }
+
+    /**
+     * @brief Waits up to timeoutMs for socket events and handles them.
+     * @return Number of connections that had events.
+     */
+    int RunOnce(int timeoutMs) {
+        std::vector<ChatConnection*> active;
+        pollFds.clear();
+        {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            for (auto& connection : connections) {
+                if (connection->state == ChatConnection::Closed) {
+                    continue;
+                }
+                short events = POLLRDNORM;
+                if (connection->state == ChatConnection::Connecting || connection->closing || HasOutbox(connection.get())) {
+                    events |= POLLWRNORM;
+                }
+                WSAPOLLFD pollFd = { connection->socket, events, 0 };
+                pollFds.push_back(pollFd);
+                active.push_back(connection.get());
+            }
+        }
+        if (pollFds.empty()) {
+            EraseClosed();
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            return 0;
+        }
+
+        int ready = WSAPoll(pollFds.data(), static_cast<ULONG>(pollFds.size()), timeoutMs);
+        if (ready <= 0) {
+            EraseClosed();
+            return 0;
+        }
+        for (size_t i = 0; i < pollFds.size(); ++i) {
+            short revents = pollFds[i].revents;
+            ChatConnection* connection = active[i];
+            if (revents == 0) {
+                continue;
+            }
+            if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                if (!(revents & POLLRDNORM) || !Receive(connection)) {
+                    Close(connection);
+                }
+                continue;
+            }
+            if (revents & POLLWRNORM) {
+                connection->state = ChatConnection::Open;
+                if (!Flush(connection) || (connection->closing && !HasOutbox(connection))) {
+                    Close(connection);
+                    continue;
+                }
+            }
+            if ((revents & POLLRDNORM) && !Receive(connection)) {
+                Close(connection);
+            }
+        }
+        EraseClosed();
+        return ready;
+    }
+
+    /** @brief Runs the loop until Stop() is called. */
+    void Run() {
+        while (!stopping) {
+            RunOnce(PollIntervalMs);
+        }
+    }
+
+    void Stop() {
+        stopping = true;
+    }
+
+private:
+    static const int PollIntervalMs = 50; // Upper bound on how long Stop() takes to be seen
+
+    std::string Prefix(ChatConnection* connection) {
+        std::lock_guard<std::mutex> lock(connection->sendMutex);
+        return connection->name + " : ";
+    }
+
+    bool HasOutbox(ChatConnection* connection) {
+        std::lock_guard<std::mutex> lock(connection->sendMutex);
+        return !connection->outbox.empty();
+    }
+
+    /**
+     * @brief Queues bytes and sends as much as the socket takes right away.
+     */
+    bool Write(ChatConnection* connection, const std::string& bytes) {
+        if (connection->state == ChatConnection::Closed) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(connection->sendMutex);
+        connection->outbox += bytes;
+        return connection->state == ChatConnection::Connecting || FlushLocked(connection);
+    }
+
+    bool Flush(ChatConnection* connection) {
+        std::lock_guard<std::mutex> lock(connection->sendMutex);
+        return FlushLocked(connection);
+    }
+
+    bool FlushLocked(ChatConnection* connection) {
+        size_t offset = 0;
+        while (offset < connection->outbox.length()) {
+            int sent = send(connection->socket, connection->outbox.data() + offset,
+                            static_cast<int>(connection->outbox.length() - offset), 0);
+            if (sent == SOCKET_ERROR) {
+                if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                    break; // The loop resumes when the socket is writable
+                }
+                return false;
+            }
+            offset += static_cast<size_t>(sent);
+        }
+        connection->outbox.erase(0, offset);
+        return true;
+    }
+
+    /**
+     * @brief Reads what is available and delivers every complete line.
+     * @return false when the server closed the connection.
+     */
+    bool Receive(ChatConnection* connection) {
+        if (connection->inbox.size() - connection->received < connection->inbox.size() / 4) {
+            connection->inbox.resize(connection->inbox.size() * 2); // A line longer than the buffer
+        }
+        int length = recv(connection->socket, connection->inbox.data() + connection->received,
+                          static_cast<int>(connection->inbox.size() - connection->received), 0);
+        if (length == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        if (length == 0) {
+            return false;
+        }
+        connection->received += static_cast<size_t>(length);
+
+        const char* data = connection->inbox.data();
+        size_t lineStart = 0;
+        while (true) {
+            const char* newline = static_cast<const char*>(memchr(data + lineStart, '\n', connection->received - lineStart));
+            if (newline == nullptr) {
+                break;
+            }
+            size_t lineLength = static_cast<size_t>(newline - (data + lineStart));
+            if (onMessage) {
+                onMessage(*connection, ChatEvent::Parse(data + lineStart, lineLength));
+            }
+            lineStart += lineLength + 1;
+        }
+        if (lineStart > 0) {
+            memmove(connection->inbox.data(), data + lineStart, connection->received - lineStart);
+            connection->received -= lineStart;
+            if (onBatchEnd) {
+                onBatchEnd(*connection);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Frees connections whose OnClosed has run, so a long-lived loop that sees
+     *        many connections come and go does not keep their buffers.
+     */
+    void EraseClosed() {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+            [](const std::unique_ptr<ChatConnection>& connection) {
+                return connection->state == ChatConnection::Closed;
+            }), connections.end());
+    }
+
+    void Close(ChatConnection* connection) {
+        if (connection->state.exchange(ChatConnection::Closed) == ChatConnection::Closed) {
+            return;
+        }
+        closesocket(connection->socket);
+        if (onClosed) {
+            onClosed(*connection);
+        }
+    }
+
+    std::atomic<bool> stopping;
+    MessageHandler onMessage;
+    ConnectionHandler onBatchEnd;
+    ConnectionHandler onClosed;
+
+    std::mutex connectionsMutex;   // Guards the list; closed connections are erased by RunOnce()
+    std::vector<std::unique_ptr<ChatConnection>> connections;
+    std::vector<WSAPOLLFD> pollFds;
+};
@@ -0,0 +1,364 @@
+/**
+ * @file ChatReplay.cpp
+ * @brief Re-drives a traffic capture against a chat server and reports latency and
+ *        throughput.
+ *
+ * The capture comes from running the server with --capture FILE. Each captured
+ * connection is opened, sent its recorded lines and closed at the recorded times,
+ * divided by --speed. The server therefore sees the original connection concurrency
+ * and traffic shape. With --max the timing is ignored and events are replayed as fast
+ * as possible, in their original order.
+ *
+ * The server answers every chat line and /reply it accepts with "__SENT__<id>" on the
+ * sending connection. The time from sending a line to that answer is reported as the
+ * ack latency. Lines it refuses (chat in a relayed room, replies to messages it does
+ * not have) get a notice instead, which names the room or parent message, so it is
+ * matched to its line and the remaining lines keep their send times. A connection is
+ * closed only once its lines have been answered, so that closing early does not lose
+ * the measurements.
+ *
+ * Usage: replay CAPTURE [--speed N | --max] [--host ADDR] [--port N] [--drain-seconds N]
+ *
+ * @author
+ * @version 1.0
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include "../client/libchatclient.h"
+
+using namespace std;
+
+/**
+ * @brief Replay options.
+ */
+struct ReplayConfig {
+    string capturePath;
+    double speed = 1.0;         // 2 replays twice as fast as captured
+    bool maxSpeed = false;      // Ignore the captured timing
+    string host = "127.0.0.1";
+    unsigned short port = 12345;
+    unsigned drainSeconds = 5;  // How long to wait for outstanding answers at the end
+};
+
+/**
+ * @brief Parses command-line options into a ReplayConfig.
+ * @return false (after printing usage) if an option is unknown or malformed.
+ */
+bool ParseArguments(int argc, char* argv[], ReplayConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--speed" && i + 1 < argc) {
+            config.speed = strtod(argv[++i], nullptr);
+        } else if (arg == "--max") {
+            config.maxSpeed = true;
+        } else if (arg == "--host" && i + 1 < argc) {
+            config.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = static_cast<unsigned short>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--drain-seconds" && i + 1 < argc) {
+            config.drainSeconds = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+        } else if (config.capturePath.empty() && arg[0] != '-') {
+            config.capturePath = arg;
+        } else {
+            config.capturePath.clear();
+            break;
+        }
+    }
+    if (config.capturePath.empty() || config.speed <= 0) {
+        cerr << "Usage: " << argv[0] << " CAPTURE [--speed N | --max] [--host ADDR] [--port N] [--drain-seconds N]" << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief One captured event; the layout matches TrafficCapture in ChatServer.cpp.
+ */
+struct CaptureEvent {
+    enum Kind : uint32_t { Open = 0, Frame = 1, Close = 2 };
+
+    uint64_t timeNs;
+    uint32_t connection;
+    Kind kind;
+    string line;
+};
+
+/**
+ * @brief Reads a capture file. A record cut off at the end (the server was still
+ *        writing) is ignored.
+ * @return false if the file cannot be read or is not a capture.
+ */
+bool LoadCapture(const string& path, vector<CaptureEvent>& events) {
+    const uint64_t Magic = 0x3150414354414843ULL; // "CHATCAP1"
+    const uint32_t LengthMask = (1u << 30) - 1;
+
+    struct CaptureHeader {
+        uint64_t magic;
+        uint64_t startUnixNs;
+    };
+    struct CaptureRecord {
+        uint64_t timeNs;
+        uint32_t connection;
+        uint32_t kindAndLength;
+    };
+
+    ifstream in(path, ios::binary);
+    CaptureHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != Magic) {
+        return false;
+    }
+    CaptureRecord record;
+    while (in.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        CaptureEvent event;
+        event.timeNs = record.timeNs;
+        event.connection = record.connection;
+        event.kind = static_cast<CaptureEvent::Kind>(record.kindAndLength >> 30);
+        event.line.resize(record.kindAndLength & LengthMask);
+        if (!event.line.empty() && !in.read(&event.line[0], static_cast<streamsize>(event.line.size()))) {
+            break;
+        }
+        events.push_back(move(event));
+    }
+    return true;
+}
+
+/**
+ * @brief A sent line waiting for its __SENT__ or refusal.
+ */
+struct PendingLine {
+    chrono::steady_clock::time_point sentAt;
+    string refusalKey; // What a refusal of this line names: "#room" for chat, the parent id for /reply
+};
+
+/**
+ * @brief Replay state of one captured connection.
+ */
+struct ReplayConnection {
+    ChatConnection* connection;
+    string room = "lobby";          // Room chat lines go to, from the /join lines sent
+    deque<PendingLine> unanswered;  // In send order
+    bool closeWhenAnswered = false;
+};
+
+/**
+ * @brief Counters collected during a replay.
+ */
+struct ReplayStats {
+    size_t connections = 0;
+    size_t connectFailures = 0;
+    size_t linesSent = 0;
+    size_t chatSent = 0;
+    size_t refused = 0;                // Chat lines the server declined with a notice
+    size_t delivered = 0;              // __MSG__ frames received by all connections
+    vector<double> ackLatenciesUs;
+};
+
+/**
+ * @brief Whether the server answers a line with __SENT__ or a refusal: plain chat and
+ *        well-formed /reply do, other commands and control frames do not.
+ * @param refusalKey Set to what a refusal of the line would name.
+ */
+bool IsChatLine(const string& line, const string& room, string& refusalKey) {
+    if (line.compare(0, 7, "/reply ") == 0) {
+        size_t space = line.find(' ', 7);
+        uint64_t parentId = strtoull(line.c_str() + 7, nullptr, 10);
+        if (parentId == 0 || space == string::npos || space + 1 >= line.length()) {
+            return false; // Usage error
+        }
+        refusalKey = to_string(parentId);
+        return true;
+    }
+    if (line.empty() || line[0] == '/' || line.compare(0, 2, "__") == 0) {
+        return false;
+    }
+    refusalKey = "#" + room;
+    return true;
+}
+
+/**
+ * @brief Recognizes the notices the server sends instead of __SENT__ when it refuses a
+ *        chat line or reply.
+ * @return What the refusal names (as in IsChatLine), or an empty string for other notices.
+ */
+string RefusalKey(const string& notice) {
+    const string readOnly = " is relayed from upstream; it is read-only here.";
+    const string noSuchMessage = "No such message: ";
+    const string message = "Message ";
+    if (notice.length() > readOnly.length() &&
+        notice.compare(notice.length() - readOnly.length(), readOnly.length(), readOnly) == 0) {
+        string subject = notice.substr(0, notice.length() - readOnly.length());
+        if (subject[0] == '#') {
+            return subject; // Chat in a relayed room
+        }
+        if (subject.compare(0, message.length(), message) == 0) {
+            return subject.substr(message.length()); // Reply to a relayed message
+        }
+        return string();
+    }
+    if (notice.compare(0, noSuchMessage.length(), noSuchMessage) == 0) {
+        return notice.substr(noSuchMessage.length());
+    }
+    return string();
+}
+
+double Percentile(const vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    return sorted[min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+/**
+ * @brief Entry point for the replay tool.
+ * @return int Exit status code.
+ */
+int main(int argc, char* argv[]) {
+    ReplayConfig config;
+    if (!ParseArguments(argc, argv, config)) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 1: Load the capture
+    vector<CaptureEvent> events;
+    if (!LoadCapture(config.capturePath, events)) {
+        cerr << "Cannot read capture " << config.capturePath << "." << endl;
+        return EXIT_FAILURE;
+    }
+    cout << "Loaded " << events.size() << " event(s) from " << config.capturePath << "." << endl;
+
+    // Step 2: Initialize Winsock
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "Winsock initialization failed. Error: " << WSAGetLastError() << endl;
+        return EXIT_FAILURE;
+    }
+
+    // Step 3: Measure answers as they arrive
+    ChatClientLoop loop;
+    ReplayStats stats;
+    map<uint32_t, ReplayConnection> live; // By capture id; map nodes keep their address
+    // A refusal is sent while the server reads the line, so it arrives before the
+    // __SENT__ of any later line: when an ack arrives, the lines before its own that
+    // were refused are already gone and it belongs to the oldest line left.
+    loop.OnMessage([&stats, &loop](ChatConnection& connection, const ChatEvent& event) {
+        ReplayConnection* replay = static_cast<ReplayConnection*>(connection.userData);
+        if (event.kind == ChatEvent::Message) {
+            ++stats.delivered;
+            return;
+        }
+        if (event.kind == ChatEvent::Sent && !replay->unanswered.empty()) {
+            chrono::duration<double, micro> latency = chrono::steady_clock::now() - replay->unanswered.front().sentAt;
+            replay->unanswered.pop_front();
+            stats.ackLatenciesUs.push_back(latency.count());
+        } else if (event.kind == ChatEvent::Notice) {
+            string key = RefusalKey(event.Text());
+            auto refused = find_if(replay->unanswered.begin(), replay->unanswered.end(),
+                                   [&key](const PendingLine& pending) { return pending.refusalKey == key; });
+            if (key.empty() || refused == replay->unanswered.end()) {
+                return;
+            }
+            replay->unanswered.erase(refused);
+            ++stats.refused;
+        } else {
+            return;
+        }
+        if (replay->unanswered.empty() && replay->closeWhenAnswered) {
+            loop.Disconnect(&connection);
+        }
+    });
+
+    loop.OnClosed([](ChatConnection& connection) {
+        static_cast<ReplayConnection*>(connection.userData)->connection = nullptr; // Freed by the loop
+    });
+
+    // Step 4: Re-drive the events on the captured schedule
+    auto start = chrono::steady_clock::now();
+    uint64_t firstNs = events.empty() ? 0 : events.front().timeNs;
+    for (size_t i = 0; i < events.size(); ++i) {
+        const CaptureEvent& event = events[i];
+        if (!config.maxSpeed) {
+            auto due = start + chrono::nanoseconds(static_cast<int64_t>((event.timeNs - firstNs) / config.speed));
+            auto now = chrono::steady_clock::now();
+            while (now < due) {
+                long long waitMs = chrono::duration_cast<chrono::milliseconds>(due - now).count();
+                loop.RunOnce(static_cast<int>(min(waitMs, 10LL))); // Below 1 ms this polls without waiting
+                now = chrono::steady_clock::now();
+            }
+        } else if ((i & 255) == 0) {
+            loop.RunOnce(0); // Keep answers flowing
+        }
+
+        if (event.kind == CaptureEvent::Open) {
+            ChatConnection* connection = loop.Connect(config.host, config.port);
+            if (connection == nullptr) {
+                ++stats.connectFailures;
+                continue;
+            }
+            ReplayConnection& replay = live[event.connection];
+            replay.connection = connection;
+            connection->userData = &replay;
+            ++stats.connections;
+            continue;
+        }
+
+        auto found = live.find(event.connection);
+        if (found == live.end() || found->second.connection == nullptr) {
+            continue; // Opened before the capture started, failed to connect or already closed
+        }
+        if (event.kind == CaptureEvent::Frame) {
+            string refusalKey;
+            if (IsChatLine(event.line, found->second.room, refusalKey)) {
+                found->second.unanswered.push_back(PendingLine{ chrono::steady_clock::now(), refusalKey });
+                ++stats.chatSent;
+            } else if (event.line.compare(0, 6, "/join ") == 0 && event.line.length() > 6) {
+                found->second.room = event.line.substr(6);
+            }
+            loop.Command(found->second.connection, event.line);
+            ++stats.linesSent;
+        } else if (found->second.unanswered.empty()) {
+            loop.Disconnect(found->second.connection);
+        } else {
+            found->second.closeWhenAnswered = true;
+        }
+    }
+    chrono::duration<double> sendSeconds = chrono::steady_clock::now() - start;
+
+    // Step 5: Wait for outstanding answers
+    auto drainUntil = chrono::steady_clock::now() + chrono::seconds(config.drainSeconds);
+    while (stats.ackLatenciesUs.size() + stats.refused < stats.chatSent && chrono::steady_clock::now() < drainUntil) {
+        loop.RunOnce(10);
+    }
+    chrono::duration<double> totalSeconds = chrono::steady_clock::now() - start;
+
+    // Step 6: Report
+    sort(stats.ackLatenciesUs.begin(), stats.ackLatenciesUs.end());
+    double capturedSeconds = events.empty() ? 0 : (events.back().timeNs - firstNs) / 1e9;
+    cout << "Replayed " << stats.connections << " connection(s) and " << stats.linesSent << " line(s) in "
+         << sendSeconds.count() << " s (captured over " << capturedSeconds << " s, "
+         << (config.maxSpeed ? string("max speed") : to_string(config.speed) + "x") << ")." << endl;
+    if (stats.connectFailures > 0) {
+        cout << "Failed to connect: " << stats.connectFailures << endl;
+    }
+    cout << "Throughput: " << stats.linesSent / max(sendSeconds.count(), 1e-9) << " lines/s sent, "
+         << stats.delivered / max(totalSeconds.count(), 1e-9) << " messages/s delivered ("
+         << stats.delivered << " total)." << endl;
+    if (stats.refused > 0) {
+        cout << "Refused by the server: " << stats.refused << " chat line(s)" << endl;
+    }
+    cout << "Ack latency over " << stats.ackLatenciesUs.size() << " of " << stats.chatSent << " chat line(s), us: p50 "
+         << Percentile(stats.ackLatenciesUs, 0.5) << ", p99 " << Percentile(stats.ackLatenciesUs, 0.99)
+         << ", p99.9 " << Percentile(stats.ackLatenciesUs, 0.999) << ", max "
+         << (stats.ackLatenciesUs.empty() ? 0 : stats.ackLatenciesUs.back()) << endl;
+
+    WSACleanup();
+    return EXIT_SUCCESS;
+}